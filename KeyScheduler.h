@@ -0,0 +1,158 @@
+#pragma once
+// Key events are sent through a scheduler so that every press is held
+// for at least minHold ms and every release lasts at least minGap ms.
+// Transitions that would break these limits are put in a two level
+// timer wheel with 1 ms ticks and sent later from the input thread.
+//
+// This file doesn't use any Windows API so the timing can be tested on
+// any platform, see tests/KeySchedulerTest.cpp.
+#include <stdint.h>
+#include <vector>
+#include <optional>
+#include <algorithm>
+
+#define WHEEL_BITS 8
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+// Furthest ahead of the current tick an event can be queued
+#define WHEEL_RANGE ((uint64_t)WHEEL_SLOTS * (WHEEL_SLOTS - 1))
+
+// A deferred key transition.
+struct key_event
+{
+    uint64_t due; // Tick the event is sent at
+    int key; // 0 for key1, 1 for key2
+    bool down;
+    uint32_t seq; // Identifies the event so it can be cancelled
+};
+
+// Level 0 holds events due within WHEEL_SLOTS ticks, level 1 holds
+// later events grouped by WHEEL_SLOTS ticks. Level 1 slots are moved
+// down into level 0 as the wheel reaches them.
+struct timer_wheel
+{
+    std::vector<key_event> slots[2][WHEEL_SLOTS];
+    uint64_t now = 0; // Last tick that was processed
+    size_t pending = 0;
+    uint32_t nextSeq = 0;
+};
+
+// Scheduler state of a key. A key has at most one queued press and one
+// queued release, in that order.
+struct key_state
+{
+    bool down = false; // Latest requested state, including queued events
+    uint64_t pressAfter = 0; // Earliest tick the next press can be sent at
+    uint64_t releaseAfter = 0; // Earliest tick the next release can be sent at
+    std::optional<key_event> queuedPress;
+    std::optional<key_event> queuedRelease;
+};
+
+struct key_scheduler
+{
+    timer_wheel wheel;
+    key_state keys[2];
+    uint64_t minHold = 0;
+    uint64_t minGap = 0;
+    void (*sink)(const key_event& e) = nullptr; // Receives events when they are due
+};
+
+static inline void WheelInsert(timer_wheel& wheel, key_event e)
+{
+    // Level 1 only covers WHEEL_SLOTS - 1 rotations ahead. Events moved
+    // down from level 1 can be due on the current tick, which is sent
+    // right after the move.
+    e.due = std::clamp(e.due, wheel.now, wheel.now + WHEEL_RANGE);
+    if (e.due - wheel.now < WHEEL_SLOTS) {
+        wheel.slots[0][e.due & WHEEL_MASK].push_back(e);
+    }
+    else {
+        wheel.slots[1][(e.due >> WHEEL_BITS) & WHEEL_MASK].push_back(e);
+    }
+}
+
+// Removes a queued event from whichever level it is in.
+static inline void WheelRemove(timer_wheel& wheel, const key_event& e)
+{
+    for (std::vector<key_event>* slot : {
+        &wheel.slots[0][e.due & WHEEL_MASK],
+        &wheel.slots[1][(e.due >> WHEEL_BITS) & WHEEL_MASK] }) {
+        auto it = std::find_if(slot->begin(), slot->end(), [&](const key_event& other) { return other.seq == e.seq; });
+        if (it != slot->end()) {
+            slot->erase(it);
+            wheel.pending--;
+            return;
+        }
+    }
+}
+
+// Sends all deferred events due up to and including the given tick.
+static inline void AdvanceKeyEvents(key_scheduler& sched, uint64_t now)
+{
+    timer_wheel& wheel = sched.wheel;
+    while (wheel.now < now && wheel.pending != 0) {
+        uint64_t tick = ++wheel.now;
+        if ((tick & WHEEL_MASK) == 0) {
+            std::vector<key_event> cascade;
+            cascade.swap(wheel.slots[1][(tick >> WHEEL_BITS) & WHEEL_MASK]);
+            for (const key_event& e : cascade) {
+                WheelInsert(wheel, e);
+            }
+        }
+        std::vector<key_event> slot;
+        slot.swap(wheel.slots[0][tick & WHEEL_MASK]);
+        for (const key_event& e : slot) {
+            key_state& state = sched.keys[e.key];
+            (e.down ? state.queuedPress : state.queuedRelease).reset();
+            sched.sink(e);
+        }
+        wheel.pending -= slot.size();
+    }
+    wheel.now = std::max(wheel.now, now);
+}
+
+// Requests a key state. Repeated requests for the same state are
+// dropped. A press that comes while a release is still queued cancels
+// that release, so the key is simply held longer; a release that comes
+// while a press is still queued is queued after it, so short taps are
+// never lost. Each key therefore has at most one press and one release
+// queued, and output never falls more than minHold + minGap behind.
+// Events are never queued more than WHEEL_RANGE ticks ahead.
+static inline void RequestKeyState(key_scheduler& sched, int key, bool down, uint64_t now)
+{
+    // Brings the wheel up to now, so due ticks up to now + WHEEL_RANGE
+    // aren't moved by WheelInsert
+    AdvanceKeyEvents(sched, now);
+
+    key_state& state = sched.keys[key];
+    if (state.down == down) {
+        return;
+    }
+    state.down = down;
+
+    if (down && state.queuedRelease.has_value()) {
+        WheelRemove(sched.wheel, state.queuedRelease.value());
+        state.queuedRelease.reset();
+        return;
+    }
+
+    // The queued copy must have the same due tick as the one in the
+    // wheel, or WheelRemove looks in the wrong slots
+    key_event e = { 0, key, down, ++sched.wheel.nextSeq };
+    if (down) {
+        e.due = std::min(std::max(now, state.pressAfter), now + WHEEL_RANGE);
+        state.releaseAfter = e.due + sched.minHold;
+    }
+    else {
+        e.due = std::min(std::max(now, state.releaseAfter), now + WHEEL_RANGE);
+        state.pressAfter = e.due + sched.minGap;
+    }
+    if (e.due <= now) {
+        sched.sink(e);
+    }
+    else {
+        WheelInsert(sched.wheel, e);
+        sched.wheel.pending++;
+        (down ? state.queuedPress : state.queuedRelease) = e;
+    }
+}
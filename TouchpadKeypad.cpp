@@ -2,18 +2,30 @@
 #include <string>
 #include <sstream>
 #include <fstream>
+#define NOMINMAX
 #include <windows.h>
 #include <stdio.h>
+#include <string.h>
 #include <hidsdi.h>
 #include <hidusage.h>
 #include <vector>
 #include <unordered_map>
 #include <optional>
+#include <algorithm>
+#include <thread>
+#include <exception>
+#include <cmath>
 #include "resource.h"
+#include "KeyScheduler.h"
 
 #define WMAPP_NOTIFYCALLBACK (WM_APP + 1)
+#define WMAPP_DEVICEREADY (WM_APP + 2)
+#define IDT_TOOLTIP 1
+#define IDT_PARSERETRY 0x100 // First timer ID for device parse retries
+#define TOOLTIP_INTERVAL_MS 1000
 #define HID_USAGE_DIGITIZER_CONTACT_ID 0x51
 #define HID_USAGE_DIGITIZER_CONTACT_COUNT 0x54
+#define HID_USAGE_DIGITIZER_SCAN_TIME 0x56
 
 #define DEBUG_MODE 0
 
@@ -22,17 +34,47 @@ HINSTANCE hInstance;
 WNDCLASSEX wc;
 NOTIFYICONDATA nid = {};
 
-RECT bounds = { -1, -1, -1, -1 };
+// Contact coordinates are normalized to [0, NORM_MAX] on both axes
+// using the logical range from the HID report descriptor.
+#define NORM_BITS 16
+#define NORM_MAX ((1 << NORM_BITS) - 1)
+
+// Touch area used to split contacts into zones. This is the whole
+// normalized range unless manual calibration is enabled.
+RECT bounds = { 0, 0, NORM_MAX, NORM_MAX };
+bool calibrate = false;
 // keys to use
 WORD key1 = 90, key2 = 88;
-// key press data
-bool k1p = false, k2p = false;
+// minimum key hold and release times in ms
+ULONG minHold = 0, minGap = 0;
 
 bool splitaxis;
+
+// Session trace recording, enabled with Trace= in config.txt. Every raw
+// report is stored with the time it was received so a session can be
+// studied afterwards with -analyze. A trace holds one descriptor, so
+// only the first touchpad that sends a report is recorded.
+#define TRACE_MAGIC 0x544B5054 // "TPKT"
+#define TRACE_VERSION 1
+std::string tracePath;
+static std::ofstream g_trace;
+static HANDLE g_traceDevice;
+
+// Logical range of a contact axis.
+struct axis_info
+{
+    LONG min = 0;
+    LONG max = 0;
+    USHORT bitSize = 0;
+    LONGLONG scale = 0; // NORM_MAX / (max - min) in 16.16 fixed point
+};
+
 // Contact information parsed from the HID report descriptor.
 struct contact_info
 {
     USHORT link;
+    axis_info x;
+    axis_info y;
 };
 
 // The data for a touch event.
@@ -48,14 +90,38 @@ struct contact
 struct free_deleter { void operator()(void* ptr) { free(ptr); } };
 template<typename T> using malloc_ptr = std::unique_ptr<T, free_deleter>;
 
+// The last touch report of a device and the keys it pressed, so that
+// reports that haven't changed can skip decoding.
+struct report_cache
+{
+    std::vector<BYTE> report;
+    bool keys[2] = { false, false };
+    ULONG hits = 0; // Reports answered from the cache
+    ULONG reports = 0;
+};
+
+// Decodes a touch report with a known layout into contacts.
+struct device_info;
+typedef void (*decode_fn)(const device_info& dev, const BYTE* report, std::vector<contact>& contacts);
+
 // Device information, such as touch area bounds and HID offsets.
 // This can be reused across HID events, so we only have to parse
 // this info once.
 struct device_info
 {
     malloc_ptr<_HIDP_PREPARSED_DATA> preparsedData; // HID internal data
+    UINT preparsedSize = 0; // Size of preparsedData in bytes
     USHORT linkContactCount = 0; // Link collection for number of contacts present
-    std::vector<contact_info> contactInfo; // Link collection and touch area for each contact
+    std::vector<contact_info> contactInfo; // Link collection and touch area for each contact, in report order
+    UCHAR reportId = 0; // Report ID of touch reports
+    USHORT reportLen = 0; // Input report length in bytes
+    ULONG countByte = 0; // Byte offset of the contact count
+    ULONG contactByte = 0; // Byte offset of the first contact
+    decode_fn decode = nullptr; // Specialized decoder, or nullptr to decode through HidP
+    const char* layoutName = nullptr; // Name of the specialized layout
+    std::vector<BYTE> reportMask; // Bits of the touch report that are compared by IsSameReport
+    report_cache cache; // Only used by HandleRawInput
+    bool keys[2] = { false, false }; // Keys this device is pressing
 };
 
 // Caches per-device info for better performance
@@ -124,6 +190,27 @@ BOOL AddNotificationIcon()
     return Shell_NotifyIcon(NIM_SETVERSION, &nid);
 }
 
+// Shows how many touch reports of all touchpads were answered from the
+// report cache in the tray icon's tooltip. Called from a timer so the
+// input path only counts.
+static void UpdateNotificationTip()
+{
+    ULONG hits = 0, reports = 0;
+    for (const auto& kvp : g_devices) {
+        hits += kvp.second.cache.hits;
+        reports += kvp.second.cache.reports;
+    }
+    char tip[sizeof(nid.szTip)];
+    snprintf(tip, sizeof(tip), "TouchpadKeypad - %lu of %lu reports unchanged", hits, reports);
+    if (strcmp(tip, nid.szTip) == 0) {
+        return;
+    }
+    debugf("Unchanged reports: %lu of %lu", hits, reports);
+    memcpy(nid.szTip, tip, sizeof(tip));
+    nid.uFlags |= NIF_SHOWTIP;
+    Shell_NotifyIcon(NIM_MODIFY, &nid);
+}
+
 // Taken from Windows 7 SDK
 void ShowContextMenu(HWND hwnd, POINT pt)
 {
@@ -156,6 +243,9 @@ void ShowContextMenu(HWND hwnd, POINT pt)
 // On exit
 void Clean() {
     Shell_NotifyIcon(NIM_DELETE, &nid);
+    if (g_trace.is_open()) {
+        g_trace.close();
+    }
     PostQuitMessage(0);
 }
 
@@ -165,7 +255,7 @@ static void RegisterTouchpadInput()
     RAWINPUTDEVICE dev;
     dev.usUsagePage = HID_USAGE_PAGE_DIGITIZER;
     dev.usUsage = HID_USAGE_DIGITIZER_TOUCH_PAD;
-    dev.dwFlags = RIDEV_INPUTSINK;
+    dev.dwFlags = RIDEV_INPUTSINK | RIDEV_DEVNOTIFY;
     dev.hwndTarget = hwnd;
     if (!RegisterRawInputDevices(&dev, 1, sizeof(RAWINPUTDEVICE))) {
         throw;
@@ -208,15 +298,17 @@ static RID_DEVICE_INFO GetRawInputDeviceInfo(HANDLE hDevice)
 
 // Reads the preparsed HID report descriptor for the device
 // that generated the given raw input.
-static malloc_ptr<_HIDP_PREPARSED_DATA> GetHidPreparsedData(HANDLE hDevice)
+static malloc_ptr<_HIDP_PREPARSED_DATA> GetHidPreparsedData(HANDLE hDevice, UINT& size)
 {
-    UINT size = 0;
+    size = 0;
+    // The device can be removed while this runs, so fail with an
+    // exception that callers can catch
     if (GetRawInputDeviceInfoW(hDevice, RIDI_PREPARSEDDATA, nullptr, &size) == (UINT)-1) {
-        throw;
+        throw std::runtime_error("Could not read preparsed data");
     }
     malloc_ptr<_HIDP_PREPARSED_DATA> preparsedData = make_malloc<_HIDP_PREPARSED_DATA>(size);
     if (GetRawInputDeviceInfoW(hDevice, RIDI_PREPARSEDDATA, preparsedData.get(), &size) == (UINT)-1) {
-        throw;
+        throw std::runtime_error("Could not read preparsed data");
     }
     return preparsedData;
 }
@@ -229,13 +321,16 @@ static std::vector<HIDP_BUTTON_CAPS> GetHidInputButtonCaps(PHIDP_PREPARSED_DATA
     HIDP_CAPS caps;
     status = HidP_GetCaps(preparsedData, &caps);
     if (status != HIDP_STATUS_SUCCESS) {
-        throw;
+        throw std::runtime_error("Could not read HID caps");
     }
     USHORT numCaps = caps.NumberInputButtonCaps;
     std::vector<HIDP_BUTTON_CAPS> buttonCaps(numCaps);
+    if (numCaps == 0) {
+        return buttonCaps;
+    }
     status = HidP_GetButtonCaps(HidP_Input, &buttonCaps[0], &numCaps, preparsedData);
     if (status != HIDP_STATUS_SUCCESS) {
-        throw;
+        throw std::runtime_error("Could not read HID button caps");
     }
     buttonCaps.resize(numCaps);
     return buttonCaps;
@@ -249,13 +344,16 @@ static std::vector<HIDP_VALUE_CAPS> GetHidInputValueCaps(PHIDP_PREPARSED_DATA pr
     HIDP_CAPS caps;
     status = HidP_GetCaps(preparsedData, &caps);
     if (status != HIDP_STATUS_SUCCESS) {
-        throw;
+        throw std::runtime_error("Could not read HID caps");
     }
     USHORT numCaps = caps.NumberInputValueCaps;
     std::vector<HIDP_VALUE_CAPS> valueCaps(numCaps);
+    if (numCaps == 0) {
+        return valueCaps;
+    }
     status = HidP_GetValueCaps(HidP_Input, &valueCaps[0], &numCaps, preparsedData);
     if (status != HIDP_STATUS_SUCCESS) {
-        throw;
+        throw std::runtime_error("Could not read HID value caps");
     }
     valueCaps.resize(numCaps);
     return valueCaps;
@@ -275,6 +373,9 @@ static bool GetHidUsageButton(
         reportType,
         usagePage,
         preparsedData);
+    if (numUsages == 0) {
+        return false;
+    }
     std::vector<USAGE> usages(numUsages);
     NTSTATUS status = HidP_GetUsages(
         reportType,
@@ -286,7 +387,7 @@ static bool GetHidUsageButton(
         (PCHAR)report,
         reportLen);
     if (status != HIDP_STATUS_SUCCESS) {
-        throw;
+        throw std::runtime_error("Could not read HID buttons");
     }
     usages.resize(numUsages);
     return std::find(usages.begin(), usages.end(), usage) != usages.end();
@@ -313,49 +414,240 @@ static ULONG GetHidUsageLogicalValue(
         (PCHAR)report,
         reportLen);
     if (status != HIDP_STATUS_SUCCESS) {
-        throw;
+        throw std::runtime_error("Could not read HID value");
     }
     return value;
 }
 
-// Reads a single HID report value in physical units.
-static LONG GetHidUsagePhysicalValue(
-    HIDP_REPORT_TYPE reportType,
+// Builds the axis range from an X or Y value cap.
+static axis_info GetAxisInfo(const HIDP_VALUE_CAPS& cap)
+{
+    axis_info axis;
+    axis.min = cap.LogicalMin;
+    axis.max = cap.LogicalMax;
+    axis.bitSize = cap.BitSize;
+    if (axis.max > axis.min) {
+        LONGLONG range = (LONGLONG)axis.max - axis.min;
+        axis.scale = (((LONGLONG)NORM_MAX << 16) + range - 1) / range;
+    }
+    return axis;
+}
+
+// Converts a logical axis value to the normalized range.
+static LONG NormalizeAxis(const axis_info& axis, ULONG raw)
+{
+    LONG value = (LONG)raw;
+    if (axis.min < 0 && axis.bitSize > 0 && axis.bitSize < 32 && (raw & (1UL << (axis.bitSize - 1)))) {
+        // Sign extend negative logical values
+        value = (LONG)(raw | ~((1UL << axis.bitSize) - 1));
+    }
+    value = std::clamp(value, axis.min, axis.max);
+    return (LONG)std::min<LONGLONG>(((LONGLONG)(value - axis.min) * axis.scale) >> 16, NORM_MAX);
+}
+
+// Finds where a usage is stored in an input report by setting it on a
+// blank report and looking at which bits changed. Returns the bit
+// offset of the field, or nullopt unless exactly bitSize contiguous
+// bits changed.
+static std::optional<ULONG> GetHidUsageBitOffset(
     USAGE usagePage,
     USHORT linkCollection,
     USAGE usage,
+    USHORT bitSize,
+    bool isButton,
+    UCHAR reportId,
     PHIDP_PREPARSED_DATA preparsedData,
-    PBYTE report,
     ULONG reportLen)
 {
-    LONG value;
-    NTSTATUS status = HidP_GetScaledUsageValue(
-        reportType,
-        usagePage,
-        linkCollection,
-        usage,
-        &value,
-        preparsedData,
-        (PCHAR)report,
-        reportLen);
+    std::vector<BYTE> blank(reportLen);
+    NTSTATUS status = HidP_InitializeReportForID(HidP_Input, reportId, preparsedData, (PCHAR)&blank[0], reportLen);
     if (status != HIDP_STATUS_SUCCESS) {
-        return -1;
+        return std::nullopt;
     }
-    return value;
+    std::vector<BYTE> report = blank;
+    if (isButton) {
+        ULONG numUsages = 1;
+        status = HidP_SetUsages(HidP_Input, usagePage, linkCollection, &usage, &numUsages, preparsedData, (PCHAR)&report[0], reportLen);
+    }
+    else {
+        ULONG value = bitSize >= 32 ? 0xFFFFFFFF : (1UL << bitSize) - 1;
+        status = HidP_SetUsageValue(HidP_Input, usagePage, linkCollection, usage, value, preparsedData, (PCHAR)&report[0], reportLen);
+    }
+    if (status != HIDP_STATUS_SUCCESS) {
+        return std::nullopt;
+    }
+
+    std::optional<ULONG> first;
+    ULONG last = 0, changed = 0;
+    for (ULONG bit = 0; bit < reportLen * 8; ++bit) {
+        if (((blank[bit / 8] ^ report[bit / 8]) >> (bit % 8)) & 1) {
+            if (!first.has_value()) {
+                first = bit;
+            }
+            last = bit;
+            changed++;
+        }
+    }
+    if (!first.has_value() || changed != bitSize || last - first.value() + 1 != bitSize) {
+        return std::nullopt;
+    }
+    return first;
 }
 
-// Gets the device info associated with the given raw input. Uses the
-// cached info if available; otherwise parses the HID report descriptor
-// and stores it into the cache.
-static device_info& GetDeviceInfo(HANDLE hDevice)
+// Bit offsets of a contact's fields in the input report.
+struct contact_offsets
 {
-    if (g_devices.count(hDevice)) {
-        return g_devices.at(hDevice);
+    ULONG tip;
+    ULONG id;
+    ULONG x;
+    ULONG y;
+};
+
+// Decoder for a common precision touchpad report shape: Contacts blocks
+// of Stride bytes, each with the tip switch in bit TipBit of its first
+// byte, an 8-bit contact ID and little endian 16-bit X and Y at the
+// given byte offsets. Every block is unpacked before the contact count
+// is checked, so the loop has a constant trip count and can be unrolled
+// and vectorized.
+template<USHORT Contacts, ULONG Stride, ULONG TipBit, ULONG IdOffset, ULONG XOffset, ULONG YOffset>
+struct fixed_layout
+{
+    // Checks the probed offsets against this layout, and stores the
+    // position of the first contact block in dev if they match.
+    static bool Matches(device_info& dev, const std::vector<contact_offsets>& offsets)
+    {
+        if (offsets.size() != Contacts || offsets[0].x / 8 < XOffset) {
+            return false;
+        }
+        ULONG base = offsets[0].x / 8 - XOffset;
+        if (base + Contacts * Stride > dev.reportLen) {
+            return false;
+        }
+        for (USHORT i = 0; i < Contacts; ++i) {
+            ULONG block = (base + i * Stride) * 8;
+            if (offsets[i].tip != block + TipBit ||
+                offsets[i].id != block + IdOffset * 8 ||
+                offsets[i].x != block + XOffset * 8 ||
+                offsets[i].y != block + YOffset * 8) {
+                return false;
+            }
+        }
+        dev.contactByte = base;
+        return true;
+    }
+
+    static void Decode(const device_info& dev, const BYTE* report, std::vector<contact>& contacts)
+    {
+        const BYTE* blocks = report + dev.contactByte;
+        bool tip[Contacts];
+        ULONG id[Contacts];
+        ULONG x[Contacts];
+        ULONG y[Contacts];
+        for (USHORT i = 0; i < Contacts; ++i) {
+            const BYTE* block = blocks + i * Stride;
+            tip[i] = (block[0] >> TipBit) & 1;
+            id[i] = block[IdOffset];
+            x[i] = block[XOffset] | (block[XOffset + 1] << 8);
+            y[i] = block[YOffset] | (block[YOffset + 1] << 8);
+        }
+
+        ULONG numContacts = std::min<ULONG>(report[dev.countByte], Contacts);
+        for (ULONG i = 0; i < numContacts; ++i) {
+            if (tip[i]) {
+                const contact_info& info = dev.contactInfo[i];
+                contacts.push_back({ info, id[i], { NormalizeAxis(info.x, x[i]), NormalizeAxis(info.y, y[i]) } });
+            }
+        }
     }
+};
+
+// Report layouts with a specialized decoder, tried in order when a
+// device is parsed. Anything else is decoded through HidP.
+#define FIXED_LAYOUT(...) { fixed_layout<__VA_ARGS__>::Matches, fixed_layout<__VA_ARGS__>::Decode, #__VA_ARGS__ }
+static const struct
+{
+    bool (*matches)(device_info& dev, const std::vector<contact_offsets>& offsets);
+    decode_fn decode;
+    const char* name;
+} g_layouts[] = {
+    // Contacts, stride, tip bit, ID, X, Y
+    FIXED_LAYOUT(5, 6, 0, 1, 2, 4),
+    FIXED_LAYOUT(5, 6, 1, 1, 2, 4),
+    FIXED_LAYOUT(10, 6, 0, 1, 2, 4),
+    FIXED_LAYOUT(10, 6, 1, 1, 2, 4),
+};
+#undef FIXED_LAYOUT
 
+// Finds where the contact count and each contact are stored in the
+// touch report. Sorts dev.contactInfo into report order and picks a
+// specialized decoder if one matches.
+static void MatchReportLayout(device_info& dev, UCHAR reportId, USHORT countBitSize)
+{
+    PHIDP_PREPARSED_DATA preparsedData = dev.preparsedData.get();
+    HIDP_CAPS caps;
+    if (HidP_GetCaps(preparsedData, &caps) != HIDP_STATUS_SUCCESS) {
+        throw std::runtime_error("Could not read HID caps");
+    }
+    dev.reportId = reportId;
+    dev.reportLen = caps.InputReportByteLength;
+
+    bool complete = true;
+    std::vector<std::pair<contact_offsets, contact_info>> contacts;
+    for (const contact_info& info : dev.contactInfo) {
+        std::optional<ULONG> tip = GetHidUsageBitOffset(HID_USAGE_PAGE_DIGITIZER, info.link, HID_USAGE_DIGITIZER_TIP_SWITCH, 1, true, reportId, preparsedData, dev.reportLen);
+        std::optional<ULONG> id = GetHidUsageBitOffset(HID_USAGE_PAGE_DIGITIZER, info.link, HID_USAGE_DIGITIZER_CONTACT_ID, 8, false, reportId, preparsedData, dev.reportLen);
+        std::optional<ULONG> x = GetHidUsageBitOffset(HID_USAGE_PAGE_GENERIC, info.link, HID_USAGE_GENERIC_X, info.x.bitSize, false, reportId, preparsedData, dev.reportLen);
+        std::optional<ULONG> y = GetHidUsageBitOffset(HID_USAGE_PAGE_GENERIC, info.link, HID_USAGE_GENERIC_Y, info.y.bitSize, false, reportId, preparsedData, dev.reportLen);
+        if (!x.has_value()) {
+            // Can't tell the report order, keep the descriptor order
+            std::sort(dev.contactInfo.begin(), dev.contactInfo.end(),
+                [](const contact_info& a, const contact_info& b) { return a.link < b.link; });
+            return;
+        }
+        complete &= tip.has_value() && id.has_value() && y.has_value() && info.x.bitSize == 16 && info.y.bitSize == 16;
+        contacts.push_back({ { tip.value_or(0), id.value_or(0), x.value(), y.value_or(0) }, info });
+    }
+
+    // Contact count slots are filled from the start of the report
+    std::sort(contacts.begin(), contacts.end(),
+        [](const auto& a, const auto& b) { return a.first.x < b.first.x; });
+    std::vector<contact_offsets> offsets;
+    for (size_t i = 0; i < contacts.size(); ++i) {
+        offsets.push_back(contacts[i].first);
+        dev.contactInfo[i] = contacts[i].second;
+    }
+
+    std::optional<ULONG> count = GetHidUsageBitOffset(HID_USAGE_PAGE_DIGITIZER, dev.linkContactCount, HID_USAGE_DIGITIZER_CONTACT_COUNT, countBitSize, false, reportId, preparsedData, dev.reportLen);
+    if (!complete || !count.has_value() || countBitSize != 8 || count.value() % 8 != 0) {
+        debugf("Using generic decoder");
+        return;
+    }
+    dev.countByte = count.value() / 8;
+
+    for (const auto& layout : g_layouts) {
+        if (layout.matches(dev, offsets)) {
+            debugf("Using decoder for layout %s", layout.name);
+            dev.decode = layout.decode;
+            dev.layoutName = layout.name;
+            return;
+        }
+    }
+    debugf("Using generic decoder");
+}
+
+// Builds the device info from a preparsed HID report descriptor. This
+// does not touch the device itself, so it also works on descriptors
+// read back from a session trace.
+static device_info ParseDeviceInfo(malloc_ptr<_HIDP_PREPARSED_DATA> preparsedData, UINT preparsedSize)
+{
     device_info dev;
     std::optional<USHORT> linkContactCount;
-    dev.preparsedData = GetHidPreparsedData(hDevice);
+    UCHAR reportId = 0;
+    USHORT countBitSize = 0;
+    std::optional<USHORT> linkScanTime;
+    USHORT scanTimeBitSize = 0;
+    dev.preparsedData = std::move(preparsedData);
+    dev.preparsedSize = preparsedSize;
 
     // Struct to hold our parser state
     struct contact_info_tmp
@@ -364,6 +656,8 @@ static device_info& GetDeviceInfo(HANDLE hDevice)
         bool hasTip = false;
         bool hasX = false;
         bool hasY = false;
+        axis_info x;
+        axis_info y;
     };
     std::unordered_map<USHORT, contact_info_tmp> contacts;
 
@@ -371,6 +665,10 @@ static device_info& GetDeviceInfo(HANDLE hDevice)
     // is actually a contact, as specified by:
     // https://docs.microsoft.com/en-us/windows-hardware/design/component-guidelines/windows-precision-touchpad-required-hid-top-level-collections
     for (const HIDP_VALUE_CAPS& cap : GetHidInputValueCaps(dev.preparsedData.get())) {
+        if (!cap.IsRange && cap.UsagePage == HID_USAGE_PAGE_DIGITIZER && cap.NotRange.Usage == HID_USAGE_DIGITIZER_SCAN_TIME) {
+            linkScanTime = cap.LinkCollection;
+            scanTimeBitSize = cap.BitSize;
+        }
         if (cap.IsRange || !cap.IsAbsolute) {
             continue;
         }
@@ -378,14 +676,20 @@ static device_info& GetDeviceInfo(HANDLE hDevice)
         if (cap.UsagePage == HID_USAGE_PAGE_GENERIC) {
             if (cap.NotRange.Usage == HID_USAGE_GENERIC_X) {
                 contacts[cap.LinkCollection].hasX = true;
+                contacts[cap.LinkCollection].x = GetAxisInfo(cap);
+                debugf("X: logical %d..%d, physical %d..%d", cap.LogicalMin, cap.LogicalMax, cap.PhysicalMin, cap.PhysicalMax);
             }
             else if (cap.NotRange.Usage == HID_USAGE_GENERIC_Y) {
                 contacts[cap.LinkCollection].hasY = true;
+                contacts[cap.LinkCollection].y = GetAxisInfo(cap);
+                debugf("Y: logical %d..%d, physical %d..%d", cap.LogicalMin, cap.LogicalMax, cap.PhysicalMin, cap.PhysicalMax);
             }
         }
         else if (cap.UsagePage == HID_USAGE_PAGE_DIGITIZER) {
             if (cap.NotRange.Usage == HID_USAGE_DIGITIZER_CONTACT_COUNT) {
                 linkContactCount = cap.LinkCollection;
+                reportId = cap.ReportID;
+                countBitSize = cap.BitSize;
             }
             else if (cap.NotRange.Usage == HID_USAGE_DIGITIZER_CONTACT_ID) {
                 contacts[cap.LinkCollection].hasContactID = true;
@@ -409,25 +713,163 @@ static device_info& GetDeviceInfo(HANDLE hDevice)
     for (const auto& kvp : contacts) {
         USHORT link = kvp.first;
         const contact_info_tmp& info = kvp.second;
-        if (info.hasContactID && info.hasTip && info.hasX && info.hasY) {
-            debugf("Contact for device %p: link=%d",
-                hDevice,
-                link);
-            dev.contactInfo.push_back({ link });
+        if (info.hasContactID && info.hasTip && info.hasX && info.hasY &&
+            info.x.scale != 0 && info.y.scale != 0) {
+            debugf("Contact: link=%d", link);
+            dev.contactInfo.push_back({ link, info.x, info.y });
+        }
+    }
+    MatchReportLayout(dev, reportId, countBitSize);
+
+    // The scan time changes with every report even if nothing moved, so
+    // leave it out when comparing reports.
+    dev.reportMask.assign(dev.reportLen, 0xFF);
+    if (linkScanTime.has_value()) {
+        std::optional<ULONG> scanTime = GetHidUsageBitOffset(HID_USAGE_PAGE_DIGITIZER, linkScanTime.value(), HID_USAGE_DIGITIZER_SCAN_TIME, scanTimeBitSize, false, reportId, dev.preparsedData.get(), dev.reportLen);
+        if (scanTime.has_value()) {
+            for (ULONG bit = scanTime.value(); bit < scanTime.value() + scanTimeBitSize; ++bit) {
+                dev.reportMask[bit / 8] &= ~(1 << (bit % 8));
+            }
+        }
+    }
+
+    return dev;
+}
+
+// Gets the device info associated with the given raw input. Uses the
+// cached info if available; otherwise parses the HID report descriptor
+// and stores it into the cache.
+static device_info& GetDeviceInfo(HANDLE hDevice)
+{
+    if (g_devices.count(hDevice)) {
+        return g_devices.at(hDevice);
+    }
+
+    UINT size;
+    malloc_ptr<_HIDP_PREPARSED_DATA> preparsedData = GetHidPreparsedData(hDevice, size);
+    debugf("Parsing descriptor for device %p", hDevice);
+    return g_devices[hDevice] = ParseDeviceInfo(std::move(preparsedData), size);
+}
+
+// A device parsed on a worker thread, posted back to the input thread
+// with WMAPP_DEVICEREADY.
+struct parsed_device
+{
+    HANDLE hDevice;
+    ULONG generation;
+    std::optional<device_info> dev; // Empty if the device can't be used
+    bool transient = false; // The descriptor couldn't be read, so it may work on a retry
+};
+
+// Devices being parsed on a worker thread. The generation tells apart a
+// parse that finished after its device was removed and the handle was
+// reused.
+static std::unordered_map<HANDLE, ULONG> g_pendingDevices;
+static ULONG g_nextGeneration;
+
+// Devices whose descriptor couldn't be read. They are parsed again from
+// a timer, waiting PARSE_RETRY_MS after the first failure and twice as
+// long after each one that follows. After PARSE_RETRIES failures the
+// device is given up on.
+#define PARSE_RETRIES 5
+#define PARSE_RETRY_MS 100
+struct parse_retry
+{
+    ULONG failures = 0;
+    UINT_PTR timer = 0; // Timer ID of the scheduled retry, or 0
+};
+static std::unordered_map<HANDLE, parse_retry> g_parseRetries;
+static UINT_PTR g_nextRetryTimer = IDT_PARSERETRY;
+
+// Starts parsing a newly attached device on a worker thread, so that
+// reading its descriptor doesn't hold up input from other devices.
+static void ParseDeviceAsync(HANDLE hDevice)
+{
+    if (g_devices.count(hDevice) || g_pendingDevices.count(hDevice)) {
+        return;
+    }
+    auto retry = g_parseRetries.find(hDevice);
+    if (retry != g_parseRetries.end() && retry->second.timer != 0) {
+        return;
+    }
+    ULONG generation = ++g_nextGeneration;
+    g_pendingDevices[hDevice] = generation;
+    debugf("Parsing descriptor for device %p", hDevice);
+
+    HWND target = hwnd;
+    std::thread([hDevice, generation, target]() {
+        parsed_device* parsed = new parsed_device{ hDevice, generation };
+        try {
+            UINT size;
+            malloc_ptr<_HIDP_PREPARSED_DATA> preparsedData;
+            try {
+                preparsedData = GetHidPreparsedData(hDevice, size);
+            }
+            catch (const std::exception&) {
+                parsed->transient = true;
+                throw;
+            }
+            parsed->dev = ParseDeviceInfo(std::move(preparsedData), size);
+        }
+        catch (const std::exception& e) {
+            debugf("Could not parse device %p: %s", hDevice, e.what());
+        }
+        if (!PostMessage(target, WMAPP_DEVICEREADY, 0, (LPARAM)parsed)) {
+            delete parsed;
+        }
+    }).detach();
+}
+
+// Publishes a device parsed by ParseDeviceAsync, unless it was removed
+// in the meantime.
+static void HandleDeviceReady(parsed_device* parsed)
+{
+    std::unique_ptr<parsed_device> owner(parsed);
+    auto it = g_pendingDevices.find(parsed->hDevice);
+    if (it == g_pendingDevices.end() || it->second != parsed->generation) {
+        debugf("Device %p was removed while parsing", parsed->hDevice);
+        return;
+    }
+    g_pendingDevices.erase(it);
+
+    // Reading the descriptor can fail while the device is still being
+    // set up. Leave it out of the cache and try again later.
+    if (parsed->transient) {
+        parse_retry& retry = g_parseRetries[parsed->hDevice];
+        if (++retry.failures < PARSE_RETRIES) {
+            UINT delay = PARSE_RETRY_MS << (retry.failures - 1);
+            retry.timer = SetTimer(hwnd, g_nextRetryTimer++, delay, nullptr);
+            debugf("Will retry device %p in %u ms", parsed->hDevice, delay);
+            return;
         }
     }
+    g_parseRetries.erase(parsed->hDevice);
 
-    return g_devices[hDevice] = std::move(dev);
+    // Devices that can't be used are kept with no contacts so they
+    // aren't parsed again for every report.
+    g_devices[parsed->hDevice] = parsed->dev.has_value() ? std::move(parsed->dev.value()) : device_info();
+    debugf("Device %p ready with %zu contacts", parsed->hDevice, g_devices[parsed->hDevice].contactInfo.size());
 }
 
-// Reads all touch contact points from a raw input event.
-static std::vector<contact> GetContacts(device_info& dev, RAWINPUT* input)
+// Handles the retry timer of a device whose descriptor couldn't be read.
+static void HandleParseRetry(UINT_PTR timer)
+{
+    KillTimer(hwnd, timer);
+    for (auto& kvp : g_parseRetries) {
+        if (kvp.second.timer == timer) {
+            kvp.second.timer = 0;
+            ParseDeviceAsync(kvp.first);
+            return;
+        }
+    }
+}
+
+// Reads all touch contact points from the HID reports of a raw input
+// event through HidP. Works for any report layout.
+static std::vector<contact> GetContactsGeneric(const device_info& dev, BYTE* rawData, DWORD sizeHid, DWORD count)
 {
     std::vector<contact> contacts;
 
-    DWORD sizeHid = input->data.hid.dwSizeHid;
-    DWORD count = input->data.hid.dwCount;
-    BYTE* rawData = input->data.hid.bRawData;
     if (count == 0) {
         debugf("Raw input contained no HID events");
         return contacts;
@@ -451,7 +893,7 @@ static std::vector<contact> GetContacts(device_info& dev, RAWINPUT* input)
     // released contacts. I interpreted the specs as a yes, but this
     // may require additional testing.
     for (ULONG i = 0; i < numContacts; ++i) {
-        contact_info& info = dev.contactInfo[i];
+        const contact_info& info = dev.contactInfo[i];
         bool tip = GetHidUsageButton(
             HidP_Input,
             HID_USAGE_PAGE_DIGITIZER,
@@ -475,7 +917,7 @@ static std::vector<contact> GetContacts(device_info& dev, RAWINPUT* input)
             rawData,
             sizeHid);
 
-        LONG x = GetHidUsagePhysicalValue(
+        ULONG x = GetHidUsageLogicalValue(
             HidP_Input,
             HID_USAGE_PAGE_GENERIC,
             info.link,
@@ -484,7 +926,7 @@ static std::vector<contact> GetContacts(device_info& dev, RAWINPUT* input)
             rawData,
             sizeHid);
 
-        LONG y = GetHidUsagePhysicalValue(
+        ULONG y = GetHidUsageLogicalValue(
             HidP_Input,
             HID_USAGE_PAGE_GENERIC,
             info.link,
@@ -493,13 +935,26 @@ static std::vector<contact> GetContacts(device_info& dev, RAWINPUT* input)
             rawData,
             sizeHid);
 
-        if (x != -1 && y != -1)
-            contacts.push_back({ info, id, { x, y } });
+        contacts.push_back({ info, id, { NormalizeAxis(info.x, x), NormalizeAxis(info.y, y) } });
     }
 
     return contacts;
 }
 
+// Reads all touch contact points from the HID reports of a raw input
+// event, using the device's specialized decoder when the report has the
+// expected shape. Only reads from dev, so it is safe to call from
+// several threads at once.
+static std::vector<contact> GetContacts(const device_info& dev, BYTE* rawData, DWORD sizeHid, DWORD count)
+{
+    if (dev.decode != nullptr && count != 0 && sizeHid == dev.reportLen && rawData[0] == dev.reportId) {
+        std::vector<contact> contacts;
+        dev.decode(dev, rawData, contacts);
+        return contacts;
+    }
+    return GetContactsGeneric(dev, rawData, sizeHid, count);
+}
+
 // Returns the primary contact for a given list of contacts. This is
 // necessary since we are mapping potentially many touches to a single
 // mouse position. Currently this just stores a global contact ID and
@@ -515,9 +970,14 @@ static contact GetPrimaryContact(const std::vector<contact>& contacts)
     return contacts[0];
 }
 
+// First line of tpcalib.dat. Files without it hold physical units
+// rather than normalized ones and are ignored.
+#define CALIB_HEADER "TPCALIB 2"
+
 void WriteCalibration() {
     std::ofstream calib;
     calib.open("tpcalib.dat");
+    calib << CALIB_HEADER << std::endl;
     calib << bounds.left << std::endl;
     calib << bounds.right << std::endl;
     calib << bounds.top << std::endl;
@@ -525,10 +985,13 @@ void WriteCalibration() {
     calib.close();
 }
 
-void ReadCalibration() {
+// Loads tpcalib.dat into bounds. Returns false if there is no saved
+// calibration, or if it was saved by an older version in physical units.
+bool LoadCalibration() {
     int i = 0;
     std::ifstream input("tpcalib.dat");
-    if (input.good()) {
+    std::string header;
+    if (input.good() && std::getline(input, header) && header == CALIB_HEADER) {
         for (std::string line; std::getline(input, line); )
         {
             switch (i) {
@@ -548,13 +1011,19 @@ void ReadCalibration() {
             i++;
         }
         debugf("Loaded calibration %d %d %d %d", bounds.left, bounds.right, bounds.top, bounds.bottom);
+        return true;
     }
-    else {
+    return false;
+}
+
+void ReadCalibration() {
+    if (!LoadCalibration()) {
         MessageBox(hwnd, "Calibrate touchpad by touching each corner after clicking ok", "TouchpadKeypad", MB_OK | MB_ICONQUESTION);
     }
 }
 
 void HandleCalibration(LONG x, LONG y) {
+    RECT old = bounds;
     if (x < bounds.left || bounds.left == -1) {
         bounds.left = x;
         WriteCalibration();
@@ -571,6 +1040,13 @@ void HandleCalibration(LONG x, LONG y) {
         bounds.bottom = y;
         WriteCalibration();
     }
+
+    // The zones moved, so cached key states are stale
+    if (bounds.left != old.left || bounds.right != old.right || bounds.top != old.top || bounds.bottom != old.bottom) {
+        for (auto& kvp : g_devices) {
+            kvp.second.cache.report.clear();
+        }
+    }
 }
 
 void ReadConfig() {
@@ -587,6 +1063,14 @@ void ReadConfig() {
                     key1 = std::stoi(s[1].c_str());
                 else if (s[0] == "Key2")
                     key2 = std::stoi(s[1].c_str());
+                else if (s[0] == "MinHold")
+                    minHold = std::stoul(s[1].c_str());
+                else if (s[0] == "MinGap")
+                    minGap = std::stoul(s[1].c_str());
+                else if (s[0] == "Calibrate")
+                    calibrate = std::stoi(s[1].c_str()) != 0;
+                else if (s[0] == "Trace")
+                    tracePath = s[1];
             }
         }
         debugf("Loaded config.txt");
@@ -610,51 +1094,667 @@ void SetKeyState(WORD vkCode, bool down)
     }
 }
 
+static key_scheduler g_scheduler;
+
+// Returns the current time in ms.
+static ULONGLONG GetTickMs()
+{
+    static LARGE_INTEGER freq = {};
+    if (freq.QuadPart == 0) {
+        QueryPerformanceFrequency(&freq);
+    }
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (ULONGLONG)(now.QuadPart / (freq.QuadPart / 1000));
+}
+
+static void SendKeyEvent(const key_event& e)
+{
+    SetKeyState(e.key == 0 ? key1 : key2, e.down);
+    debugf("%d %s", e.key + 1, e.down ? "down" : "up");
+}
+
+// Returns which key a contact presses: 0 for key1, 1 for key2. The
+// touch area is split in half along the axis selected by splitaxis.
+static int GetContactZone(const contact& contact, const RECT& bounds)
+{
+    if (splitaxis) {
+        return contact.point.x < bounds.left + ((bounds.right - bounds.left) / 2) ? 0 : 1;
+    }
+    return contact.point.y < bounds.top + ((bounds.bottom - bounds.top) / 2) ? 0 : 1;
+}
+
+template<typename T>
+static void WriteTraceValue(std::ostream& out, const T& value)
+{
+    out.write((const char*)&value, sizeof(T));
+}
+
+template<typename T>
+static T ReadTraceValue(std::istream& in)
+{
+    T value;
+    if (!in.read((char*)&value, sizeof(T))) {
+        throw std::runtime_error("Trace file is truncated");
+    }
+    return value;
+}
+
+// Appends a raw input event to the session trace. The trace is opened
+// on the first event and starts with the preparsed descriptor of the
+// device, so only events from that device are recorded.
+static void WriteTraceRecord(HANDLE hDevice, const device_info& dev, RAWINPUT* input)
+{
+    if (tracePath.empty()) {
+        return;
+    }
+
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+
+    if (!g_trace.is_open()) {
+        g_trace.open(tracePath, std::ios::binary | std::ios::trunc);
+        if (!g_trace.good()) {
+            debugf("Could not open trace %s", tracePath.c_str());
+            tracePath.clear();
+            return;
+        }
+        LARGE_INTEGER freq;
+        QueryPerformanceFrequency(&freq);
+        WriteTraceValue<DWORD>(g_trace, TRACE_MAGIC);
+        WriteTraceValue<DWORD>(g_trace, TRACE_VERSION);
+        WriteTraceValue<LONGLONG>(g_trace, freq.QuadPart);
+        WriteTraceValue<UINT>(g_trace, dev.preparsedSize);
+        g_trace.write((const char*)dev.preparsedData.get(), dev.preparsedSize);
+        g_traceDevice = hDevice;
+        debugf("Recording trace to %s", tracePath.c_str());
+    }
+    if (hDevice != g_traceDevice) {
+        return;
+    }
+
+    DWORD sizeHid = input->data.hid.dwSizeHid;
+    DWORD count = input->data.hid.dwCount;
+    WriteTraceValue<LONGLONG>(g_trace, now.QuadPart);
+    WriteTraceValue<DWORD>(g_trace, sizeHid);
+    WriteTraceValue<DWORD>(g_trace, count);
+    g_trace.write((const char*)input->data.hid.bRawData, (std::streamsize)sizeHid * count);
+}
+
+// Returns true if two touch reports only differ in bits that are
+// masked out of the comparison, such as the scan time.
+static bool IsSameReport(const device_info& dev, const BYTE* a, const BYTE* b, DWORD size)
+{
+    if (size != dev.reportMask.size()) {
+        return false;
+    }
+    BYTE diff = 0;
+    for (DWORD i = 0; i < size; ++i) {
+        diff |= (a[i] ^ b[i]) & dev.reportMask[i];
+    }
+    return diff == 0;
+}
+
+// Requests each key as pressed while any touchpad presses it, so
+// several touchpads don't release each other's keys.
+static void RequestDeviceKeys(ULONGLONG now)
+{
+    for (int key = 0; key < 2; ++key) {
+        bool down = false;
+        for (const auto& kvp : g_devices) {
+            down |= kvp.second.keys[key];
+        }
+        RequestKeyState(g_scheduler, key, down, now);
+    }
+}
+
 // Handles a WM_INPUT event
 static void HandleRawInput(WPARAM* wParam, LPARAM* lParam)
 {
-    bool k1 = false, k2 = false; // Key press states
+    bool keys[2] = { false, false }; // Key press states
     HRAWINPUT hInput = (HRAWINPUT)*lParam;
     RAWINPUTHEADER hdr = GetRawInputHeader(hInput);
-    device_info& dev = GetDeviceInfo(hdr.hDevice);
+    auto it = g_devices.find(hdr.hDevice);
+    if (it == g_devices.end()) {
+        // Drop reports until the device has been parsed, in case its
+        // arrival wasn't announced
+        ParseDeviceAsync(hdr.hDevice);
+        return;
+    }
+    device_info& dev = it->second;
+    if (dev.contactInfo.empty()) {
+        return;
+    }
     malloc_ptr<RAWINPUT> input = GetRawInput(hInput, hdr);
-    std::vector<contact> contacts = GetContacts(dev, input.get());
+    WriteTraceRecord(hdr.hDevice, dev, input.get());
 
-    if (contacts.empty()) {
-        debugf("Found no contacts in input event");
+    BYTE* rawData = input->data.hid.bRawData;
+    DWORD sizeHid = input->data.hid.dwSizeHid;
+    DWORD count = input->data.hid.dwCount;
+    report_cache& cache = dev.cache;
+    cache.reports++;
+    if (count == 1 && sizeHid == cache.report.size() && IsSameReport(dev, rawData, cache.report.data(), sizeHid)) {
+        // Nothing moved since the last report
+        keys[0] = cache.keys[0];
+        keys[1] = cache.keys[1];
+        cache.hits++;
     }
-    for (const contact& contact : contacts) {
-        HandleCalibration(contact.point.x, contact.point.y);
-        if (splitaxis) {
-            k1 |= (contact.point.x < bounds.left + ((bounds.right - bounds.left) / 2));
-            k2 |= !(contact.point.x < bounds.left + ((bounds.right - bounds.left) / 2));
+    else {
+        std::vector<contact> contacts = GetContacts(dev, rawData, sizeHid, count);
+
+        if (contacts.empty()) {
+            debugf("Found no contacts in input event");
+        }
+        for (const contact& contact : contacts) {
+            if (calibrate) {
+                HandleCalibration(contact.point.x, contact.point.y);
+            }
+            keys[GetContactZone(contact, bounds)] = true;
+        }
+
+        if (count == 1) {
+            cache.report.assign(rawData, rawData + sizeHid);
+            cache.keys[0] = keys[0];
+            cache.keys[1] = keys[1];
         }
         else {
-            k1 |= (contact.point.y < bounds.top + ((bounds.bottom - bounds.top) / 2));
-            k2 |= !(contact.point.y < bounds.top + ((bounds.bottom - bounds.top) / 2));
+            cache.report.clear();
+        }
+    }
+
+    dev.keys[0] = keys[0];
+    dev.keys[1] = keys[1];
+    RequestDeviceKeys(GetTickMs());
+}
+
+// Handles a WM_INPUT_DEVICE_CHANGE event
+static void HandleDeviceChange(WPARAM change, HANDLE hDevice)
+{
+    if (change == GIDC_ARRIVAL) {
+        ParseDeviceAsync(hDevice);
+    }
+    else if (change == GIDC_REMOVAL) {
+        debugf("Device %p removed", hDevice);
+        g_devices.erase(hDevice);
+        g_pendingDevices.erase(hDevice);
+        auto retry = g_parseRetries.find(hDevice);
+        if (retry != g_parseRetries.end()) {
+            if (retry->second.timer != 0) {
+                KillTimer(hwnd, retry->second.timer);
+            }
+            g_parseRetries.erase(retry);
+        }
+        if (hDevice == g_traceDevice) {
+            g_traceDevice = nullptr;
+        }
+
+        // Release keys that only the removed device was pressing
+        RequestDeviceKeys(GetTickMs());
+    }
+}
+
+// Offline analysis of session traces, run with -analyze <trace>.
+// Reports are decoded in parallel, then key presses are replayed in
+// order with the same zone logic as HandleRawInput.
+#define HEATMAP_COLS 16
+#define HEATMAP_ROWS 8
+#define DURATION_BUCKET_MS 10
+#define DURATION_BUCKETS 20
+#define CHATTER_MS 15.0
+#define STREAM_MS 300.0
+
+// Largest number of reports in one raw input event that ReadTrace
+// accepts, to catch corrupt traces before allocating for them.
+#define TRACE_MAX_BATCH 256
+
+// A single raw input event read back from a trace.
+struct trace_record
+{
+    LONGLONG time; // QueryPerformanceCounter ticks
+    DWORD sizeHid;
+    DWORD count;
+    std::vector<BYTE> data;
+};
+
+// The decoded contacts of a trace record.
+struct trace_frame
+{
+    LONGLONG time;
+    std::vector<contact> contacts;
+};
+
+// Press statistics for one key.
+struct key_stats
+{
+    std::vector<double> durations; // Press durations in ms
+    std::vector<double> intervals; // Time between consecutive presses in ms
+    ULONG chatter = 0; // Presses starting within CHATTER_MS of a release
+    LONGLONG pressTime = -1;
+    LONGLONG releaseTime = -1;
+};
+
+// Reads a trace written by WriteTraceRecord. The descriptor at the start
+// of the file is parsed into dev.
+static std::vector<trace_record> ReadTrace(const std::wstring& path, device_info& dev, LONGLONG& freq)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in.good()) {
+        throw std::runtime_error("Could not open trace");
+    }
+    if (ReadTraceValue<DWORD>(in) != TRACE_MAGIC || ReadTraceValue<DWORD>(in) != TRACE_VERSION) {
+        throw std::runtime_error("Not a TouchpadKeypad trace");
+    }
+    freq = ReadTraceValue<LONGLONG>(in);
+    UINT preparsedSize = ReadTraceValue<UINT>(in);
+    malloc_ptr<_HIDP_PREPARSED_DATA> preparsedData = make_malloc<_HIDP_PREPARSED_DATA>(preparsedSize);
+    if (!in.read((char*)preparsedData.get(), preparsedSize)) {
+        throw std::runtime_error("Trace file is truncated");
+    }
+    dev = ParseDeviceInfo(std::move(preparsedData), preparsedSize);
+
+    std::vector<trace_record> records;
+    while (in.peek() != EOF) {
+        trace_record record;
+        record.time = ReadTraceValue<LONGLONG>(in);
+        record.sizeHid = ReadTraceValue<DWORD>(in);
+        record.count = ReadTraceValue<DWORD>(in);
+        if (record.sizeHid == 0 || record.sizeHid > dev.reportLen || record.count > TRACE_MAX_BATCH) {
+            throw std::runtime_error("Trace contains a report that doesn't match its descriptor");
+        }
+        record.data.resize((size_t)record.sizeHid * record.count);
+        if (!in.read((char*)record.data.data(), record.data.size())) {
+            throw std::runtime_error("Trace file is truncated");
+        }
+        records.push_back(std::move(record));
+    }
+    return records;
+}
+
+// Number of chunks ParallelChunks splits work into.
+static size_t GetChunkCount()
+{
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Splits [0, n) into GetChunkCount() contiguous chunks and calls
+// fn(chunk, begin, end) for each on its own thread. Callers merge
+// per-chunk results in chunk order, so the result does not depend on
+// how the threads are scheduled.
+template<typename F>
+static void ParallelChunks(size_t n, F fn)
+{
+    size_t numChunks = GetChunkCount();
+    size_t chunkSize = (n + numChunks - 1) / numChunks;
+    std::vector<std::thread> threads;
+    std::vector<std::exception_ptr> errors(numChunks);
+    for (size_t chunk = 0; chunk < numChunks; ++chunk) {
+        size_t begin = std::min(n, chunk * chunkSize);
+        size_t end = std::min(n, begin + chunkSize);
+        threads.emplace_back([&, chunk, begin, end]() {
+            try {
+                fn(chunk, begin, end);
+            }
+            catch (...) {
+                errors[chunk] = std::current_exception();
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    for (const std::exception_ptr& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+}
+
+// Returns the p-th percentile of a sorted list.
+static double Percentile(const std::vector<double>& sorted, double p)
+{
+    if (sorted.empty()) {
+        return 0;
+    }
+    return sorted[(size_t)(p * (sorted.size() - 1) + 0.5)];
+}
+
+static void WriteKeyStats(std::ostream& out, const char* name, WORD vkCode, key_stats& stats)
+{
+    std::sort(stats.durations.begin(), stats.durations.end());
+    out << name << " (vk " << vkCode << ")" << std::endl;
+    out << "  presses:  " << stats.durations.size() << std::endl;
+    out << "  chatter:  " << stats.chatter << std::endl;
+    if (!stats.durations.empty()) {
+        out << "  duration: min " << stats.durations.front()
+            << " p50 " << Percentile(stats.durations, 0.5)
+            << " p90 " << Percentile(stats.durations, 0.9)
+            << " p99 " << Percentile(stats.durations, 0.99)
+            << " max " << stats.durations.back() << " ms" << std::endl;
+
+        std::vector<ULONG> buckets(DURATION_BUCKETS);
+        for (double duration : stats.durations) {
+            buckets[std::min((size_t)(duration / DURATION_BUCKET_MS), buckets.size() - 1)]++;
+        }
+        for (size_t i = 0; i < buckets.size(); ++i) {
+            out << "    " << (i * DURATION_BUCKET_MS) << (i + 1 == buckets.size() ? "+" : "") << " ms: " << buckets[i] << std::endl;
+        }
+    }
+    if (!stats.intervals.empty()) {
+        // Timing spread only means something within a run of taps, so
+        // split the intervals into bursts at pauses of STREAM_MS or more
+        // and measure each interval against its own burst's mean.
+        double deviation = 0;
+        size_t streamIntervals = 0, bursts = 0;
+        for (size_t begin = 0; begin < stats.intervals.size(); ) {
+            size_t end = begin;
+            double mean = 0;
+            while (end < stats.intervals.size() && stats.intervals[end] < STREAM_MS) {
+                mean += stats.intervals[end++];
+            }
+            if (end - begin > 1) {
+                mean /= end - begin;
+                for (size_t i = begin; i < end; ++i) {
+                    deviation += (stats.intervals[i] - mean) * (stats.intervals[i] - mean);
+                }
+                streamIntervals += end - begin;
+                bursts++;
+            }
+            begin = std::max(end, begin + 1);
         }
 
+        std::sort(stats.intervals.begin(), stats.intervals.end());
+        out << "  interval: p10 " << Percentile(stats.intervals, 0.1)
+            << " p50 " << Percentile(stats.intervals, 0.5)
+            << " p90 " << Percentile(stats.intervals, 0.9) << " ms" << std::endl;
+        if (streamIntervals != 0) {
+            double stddev = std::sqrt(deviation / streamIntervals);
+            out << "  unstable rate: " << stddev * 10
+                << " (10 x stddev in ms of intervals from their burst's mean, "
+                << streamIntervals << " intervals in " << bursts << " bursts of presses under "
+                << STREAM_MS << " ms apart)" << std::endl;
+        }
     }
-    if(k1 && !k1p) {
-        SetKeyState(key1, true);
-        debugf("1 up");
-        k1p = true;
+}
+
+// Decodes a session trace and writes a report next to it.
+static void AnalyzeTrace(const std::wstring& path)
+{
+    device_info dev;
+    LONGLONG freq;
+    std::vector<trace_record> records = ReadTrace(path, dev, freq);
+
+    std::vector<trace_frame> frames(records.size());
+    ParallelChunks(records.size(), [&](size_t, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            trace_record& record = records[i];
+            frames[i].time = record.time;
+            frames[i].contacts = GetContacts(dev, record.data.data(), record.sizeHid, record.count);
+        }
+    });
+
+    if (calibrate) {
+        LoadCalibration();
     }
-    else if (!k1 && k1p) {
-        SetKeyState(key1, false);
-        debugf("1 down");
-        k1p = false;
+
+    // Heatmap of contact positions. Each chunk fills its own grid and
+    // the grids are summed afterwards.
+    LONG width = std::max(1L, bounds.right - bounds.left + 1);
+    LONG height = std::max(1L, bounds.bottom - bounds.top + 1);
+    std::vector<std::vector<ULONG>> grids(GetChunkCount());
+    ParallelChunks(frames.size(), [&](size_t chunk, size_t begin, size_t end) {
+        std::vector<ULONG> grid(HEATMAP_COLS * HEATMAP_ROWS);
+        for (size_t i = begin; i < end; ++i) {
+            for (const contact& contact : frames[i].contacts) {
+                LONG col = std::clamp((contact.point.x - bounds.left) * HEATMAP_COLS / width, 0L, (LONG)HEATMAP_COLS - 1);
+                LONG row = std::clamp((contact.point.y - bounds.top) * HEATMAP_ROWS / height, 0L, (LONG)HEATMAP_ROWS - 1);
+                grid[row * HEATMAP_COLS + col]++;
+            }
+        }
+        grids[chunk] = std::move(grid);
+    });
+    std::vector<ULONG> heatmap(HEATMAP_COLS * HEATMAP_ROWS);
+    for (size_t chunk = 0; chunk < grids.size(); ++chunk) {
+        for (size_t i = 0; i < grids[chunk].size(); ++i) {
+            heatmap[i] += grids[chunk][i];
+        }
     }
-    if (k2 & !k2p) {
-        SetKeyState(key2, true);
-        debugf("2 up");
-        k2p = true;
+
+    // Replay key presses in order
+    key_stats keys[2];
+    bool pressed[2] = { false, false };
+    for (const trace_frame& frame : frames) {
+        bool down[2] = { false, false };
+        for (const contact& contact : frame.contacts) {
+            down[GetContactZone(contact, bounds)] = true;
+        }
+        for (int k = 0; k < 2; ++k) {
+            key_stats& stats = keys[k];
+            if (down[k] && !pressed[k]) {
+                if (stats.releaseTime != -1 && (frame.time - stats.releaseTime) * 1000.0 / freq < CHATTER_MS) {
+                    stats.chatter++;
+                }
+                if (stats.pressTime != -1) {
+                    stats.intervals.push_back((frame.time - stats.pressTime) * 1000.0 / freq);
+                }
+                stats.pressTime = frame.time;
+            }
+            else if (!down[k] && pressed[k]) {
+                stats.durations.push_back((frame.time - stats.pressTime) * 1000.0 / freq);
+                stats.releaseTime = frame.time;
+            }
+            pressed[k] = down[k];
+        }
+    }
+
+    std::ofstream out(path + L".txt");
+    size_t unchanged = 0;
+    for (size_t i = 1; i < records.size(); ++i) {
+        const trace_record& prev = records[i - 1];
+        const trace_record& record = records[i];
+        if (record.count == 1 && prev.count == 1 && record.sizeHid == prev.sizeHid &&
+            IsSameReport(dev, record.data.data(), prev.data.data(), record.sizeHid)) {
+            unchanged++;
+        }
+    }
+
+    out << "Reports: " << records.size() << std::endl;
+    if (!records.empty()) {
+        out << "Unchanged: " << unchanged << " (" << unchanged * 100.0 / records.size() << "%)" << std::endl;
     }
-    else if (!k2 && k2p) {
-        SetKeyState(key2, false);
-        debugf("2 down");
-        k2p = false;
+    if (!frames.empty()) {
+        out << "Length:  " << (frames.back().time - frames.front().time) / (double)freq << " s" << std::endl;
     }
+    out << "Bounds:  " << bounds.left << " " << bounds.right << " " << bounds.top << " " << bounds.bottom
+        << (splitaxis ? " (split on x)" : " (split on y)") << std::endl << std::endl;
+    WriteKeyStats(out, "Key1", key1, keys[0]);
+    WriteKeyStats(out, "Key2", key2, keys[1]);
+
+    out << std::endl << "Contact heatmap (| and - mark the zone split)" << std::endl;
+    for (int row = 0; row < HEATMAP_ROWS; ++row) {
+        if (!splitaxis && row == HEATMAP_ROWS / 2) {
+            out << std::string(HEATMAP_COLS * 7, '-') << std::endl;
+        }
+        for (int col = 0; col < HEATMAP_COLS; ++col) {
+            if (splitaxis && col == HEATMAP_COLS / 2) {
+                out << "|";
+            }
+            out.width(7);
+            out << heatmap[row * HEATMAP_COLS + col];
+        }
+        out << std::endl;
+    }
+}
+
+// Times the specialized decoder against the generic HidP decoder on
+// synthetic reports. -benchmark <trace> uses the descriptor from a
+// trace, -benchmark on its own the attached touchpad.
+#define BENCHMARK_DECODES 200000
+#define BENCHMARK_MAX_CONTACTS 10
+#define BENCHMARK_VARIANTS 64
+
+// Builds touch reports with the given number of contacts down at
+// pseudo-random positions, using HidP so that they follow the device's
+// descriptor exactly.
+static std::vector<std::vector<BYTE>> BuildSyntheticReports(const device_info& dev, ULONG numContacts)
+{
+    PHIDP_PREPARSED_DATA preparsedData = dev.preparsedData.get();
+    std::vector<std::vector<BYTE>> reports;
+    ULONG seed = numContacts;
+    auto random = [&seed](LONG min, LONG max) {
+        seed = seed * 1103515245 + 12345;
+        return (ULONG)(min + (LONG)((seed >> 8) % (ULONG)(max - min + 1)));
+    };
+    auto check = [](NTSTATUS status) {
+        if (status != HIDP_STATUS_SUCCESS) {
+            throw std::runtime_error("Could not build synthetic report");
+        }
+    };
+
+    for (int variant = 0; variant < BENCHMARK_VARIANTS; ++variant) {
+        std::vector<BYTE> report(dev.reportLen);
+        PCHAR data = (PCHAR)&report[0];
+        check(HidP_InitializeReportForID(HidP_Input, dev.reportId, preparsedData, data, dev.reportLen));
+        check(HidP_SetUsageValue(HidP_Input, HID_USAGE_PAGE_DIGITIZER, dev.linkContactCount, HID_USAGE_DIGITIZER_CONTACT_COUNT, numContacts, preparsedData, data, dev.reportLen));
+        for (ULONG i = 0; i < numContacts; ++i) {
+            const contact_info& info = dev.contactInfo[i];
+            USAGE tip = HID_USAGE_DIGITIZER_TIP_SWITCH;
+            ULONG numUsages = 1;
+            check(HidP_SetUsages(HidP_Input, HID_USAGE_PAGE_DIGITIZER, info.link, &tip, &numUsages, preparsedData, data, dev.reportLen));
+            check(HidP_SetUsageValue(HidP_Input, HID_USAGE_PAGE_DIGITIZER, info.link, HID_USAGE_DIGITIZER_CONTACT_ID, i, preparsedData, data, dev.reportLen));
+            check(HidP_SetUsageValue(HidP_Input, HID_USAGE_PAGE_GENERIC, info.link, HID_USAGE_GENERIC_X, random(info.x.min, info.x.max), preparsedData, data, dev.reportLen));
+            check(HidP_SetUsageValue(HidP_Input, HID_USAGE_PAGE_GENERIC, info.link, HID_USAGE_GENERIC_Y, random(info.y.min, info.y.max), preparsedData, data, dev.reportLen));
+        }
+        reports.push_back(std::move(report));
+    }
+    return reports;
+}
+
+static void BenchmarkDecoders(const device_info& dev, std::ostream& out)
+{
+    if (dev.decode == nullptr) {
+        out << "No specialized decoder matches this device" << std::endl;
+        return;
+    }
+    out << "Layout: " << dev.layoutName << std::endl;
+
+    LARGE_INTEGER perf;
+    QueryPerformanceFrequency(&perf);
+    for (ULONG numContacts = 1; numContacts <= BENCHMARK_MAX_CONTACTS; ++numContacts) {
+        out << numContacts << " contacts: ";
+        if (numContacts > dev.contactInfo.size()) {
+            out << "device only has " << dev.contactInfo.size() << " contact slots" << std::endl;
+            continue;
+        }
+        std::vector<std::vector<BYTE>> reports = BuildSyntheticReports(dev, numContacts);
+
+        // Both decoders have to agree before their timings mean anything
+        size_t mismatches = 0;
+        for (std::vector<BYTE>& report : reports) {
+            std::vector<contact> generic = GetContactsGeneric(dev, report.data(), dev.reportLen, 1);
+            std::vector<contact> specialized = GetContacts(dev, report.data(), dev.reportLen, 1);
+            if (generic.size() != numContacts || generic.size() != specialized.size() ||
+                !std::equal(generic.begin(), generic.end(), specialized.begin(), [](const contact& a, const contact& b) {
+                    return a.id == b.id && a.point.x == b.point.x && a.point.y == b.point.y;
+                })) {
+                mismatches++;
+            }
+        }
+
+        size_t repeats = BENCHMARK_DECODES / reports.size();
+        size_t decodes = repeats * reports.size();
+        size_t found = 0;
+        LARGE_INTEGER start, mid, end;
+        QueryPerformanceCounter(&start);
+        for (size_t i = 0; i < repeats; ++i) {
+            for (std::vector<BYTE>& report : reports) {
+                found += GetContactsGeneric(dev, report.data(), dev.reportLen, 1).size();
+            }
+        }
+        QueryPerformanceCounter(&mid);
+        for (size_t i = 0; i < repeats; ++i) {
+            for (std::vector<BYTE>& report : reports) {
+                found += GetContacts(dev, report.data(), dev.reportLen, 1).size();
+            }
+        }
+        QueryPerformanceCounter(&end);
+
+        double generic = (mid.QuadPart - start.QuadPart) * 1e9 / perf.QuadPart / decodes;
+        double specialized = (end.QuadPart - mid.QuadPart) * 1e9 / perf.QuadPart / decodes;
+        out << "generic " << generic << " ns, specialized " << specialized
+            << " ns, " << generic / specialized << "x";
+        if (mismatches != 0) {
+            out << ", " << mismatches << " MISMATCHED";
+        }
+        out << " (" << found << " contacts)" << std::endl;
+    }
+}
+
+// Benchmarks the attached touchpad and writes benchmark.txt.
+static void BenchmarkDevice()
+{
+    std::ofstream out("benchmark.txt");
+    for (const auto& kvp : g_devices) {
+        if (!kvp.second.contactInfo.empty()) {
+            BenchmarkDecoders(kvp.second, out);
+            return;
+        }
+    }
+    out << "No precision touchpad detected" << std::endl;
+}
+
+// Measures how often reports in a trace are unchanged and what that
+// saves, then benchmarks the decoders with the trace's descriptor. The
+// result is written next to the trace.
+static void BenchmarkTrace(const std::wstring& path)
+{
+    device_info dev;
+    LONGLONG freq;
+    std::vector<trace_record> records = ReadTrace(path, dev, freq);
+
+    std::ofstream out(path + L".bench.txt");
+    LARGE_INTEGER perf;
+    QueryPerformanceFrequency(&perf);
+
+    // Cost of the unchanged report check against decoding and
+    // classifying the same reports
+    std::vector<std::pair<trace_record*, trace_record*>> unchanged;
+    for (size_t i = 1; i < records.size(); ++i) {
+        trace_record& prev = records[i - 1];
+        trace_record& record = records[i];
+        if (record.count == 1 && prev.count == 1 && record.sizeHid == prev.sizeHid &&
+            IsSameReport(dev, record.data.data(), prev.data.data(), record.sizeHid)) {
+            unchanged.push_back({ &record, &prev });
+        }
+    }
+    out << "Unchanged reports: " << unchanged.size() << " of " << records.size() << std::endl;
+    if (!unchanged.empty()) {
+        size_t repeats = std::max<size_t>(1, BENCHMARK_DECODES / unchanged.size());
+        size_t checks = repeats * unchanged.size();
+        size_t found = 0;
+        LARGE_INTEGER start, mid, end;
+        QueryPerformanceCounter(&start);
+        for (size_t i = 0; i < repeats; ++i) {
+            for (const auto& pair : unchanged) {
+                found += IsSameReport(dev, pair.first->data.data(), pair.second->data.data(), pair.first->sizeHid);
+            }
+        }
+        QueryPerformanceCounter(&mid);
+        for (size_t i = 0; i < repeats; ++i) {
+            for (const auto& pair : unchanged) {
+                trace_record* record = pair.first;
+                for (const contact& contact : GetContacts(dev, record->data.data(), record->sizeHid, record->count)) {
+                    found += GetContactZone(contact, bounds);
+                }
+            }
+        }
+        QueryPerformanceCounter(&end);
+        double compare = (mid.QuadPart - start.QuadPart) * 1e9 / perf.QuadPart / checks;
+        double decode = (end.QuadPart - mid.QuadPart) * 1e9 / perf.QuadPart / checks;
+        out << "  compare " << compare << " ns, decode " << decode << " ns, "
+            << decode / compare << "x (" << found << ")" << std::endl;
+    }
+    out << std::endl;
+    BenchmarkDecoders(dev, out);
 }
 
 BOOL HasPrecisionTouchpad() {
@@ -711,6 +1811,20 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT Msg, WPARAM wParam, LPARAM lParam)
     case WM_INPUT:
         HandleRawInput(&wParam, &lParam);
         break;
+    case WM_INPUT_DEVICE_CHANGE:
+        HandleDeviceChange(wParam, (HANDLE)lParam);
+        break;
+    case WMAPP_DEVICEREADY:
+        HandleDeviceReady((parsed_device*)lParam);
+        break;
+    case WM_TIMER:
+        if (wParam == IDT_TOOLTIP) {
+            UpdateNotificationTip();
+        }
+        else {
+            HandleParseRetry(wParam);
+        }
+        break;
     case WM_COMMAND:
         if (LOWORD(wParam) == ID_EXIT_EXIT)
             Clean();
@@ -745,10 +1859,41 @@ int APIENTRY wWinMain(_In_ HINSTANCE _hInstance,
     _In_ int       nCmdShow)
 {
     UNREFERENCED_PARAMETER(hPrevInstance);
-    UNREFERENCED_PARAMETER(lpCmdLine);
 
     MSG msg;
 
+    int argc;
+    LPWSTR* argv = CommandLineToArgvW(lpCmdLine, &argc);
+    if (argv != nullptr && argc == 2 && (wcscmp(argv[0], L"-analyze") == 0 || wcscmp(argv[0], L"-benchmark") == 0)) {
+        ReadConfig();
+        try {
+            if (wcscmp(argv[0], L"-analyze") == 0) {
+                AnalyzeTrace(argv[1]);
+            }
+            else {
+                BenchmarkTrace(argv[1]);
+            }
+        }
+        catch (const std::exception& e) {
+            MessageBox(NULL, e.what(), "TouchpadKeypad", MB_OK | MB_ICONERROR);
+        }
+        LocalFree(argv);
+        return 0;
+    }
+    if (argv != nullptr && argc == 1 && wcscmp(argv[0], L"-benchmark") == 0) {
+        LocalFree(argv);
+        ReadConfig();
+        try {
+            HasPrecisionTouchpad();
+            BenchmarkDevice();
+        }
+        catch (const std::exception& e) {
+            MessageBox(NULL, e.what(), "TouchpadKeypad", MB_OK | MB_ICONERROR);
+        }
+        return 0;
+    }
+    LocalFree(argv);
+
     hInstance = _hInstance;
     wc.cbSize = sizeof(WNDCLASSEX);
     wc.lpfnWndProc = WndProc;
@@ -770,15 +1915,39 @@ int APIENTRY wWinMain(_In_ HINSTANCE _hInstance,
     }
     SetPriorityClass(GetCurrentProcess(), HIGH_PRIORITY_CLASS); // Reduce input lag
     AddNotificationIcon();
+    SetTimer(hwnd, IDT_TOOLTIP, TOOLTIP_INTERVAL_MS, nullptr);
     ReadConfig();
-    ReadCalibration();
+    if (calibrate) {
+        bounds = { -1, -1, -1, -1 };
+        ReadCalibration();
+    }
+    g_scheduler.minHold = minHold;
+    g_scheduler.minGap = minGap;
+    g_scheduler.sink = SendKeyEvent;
     RegisterTouchpadInput();
 
-    while (GetMessage(&msg, nullptr, 0, 0))
-    {
-        TranslateMessage(&msg);
-        DispatchMessage(&msg);
+    // Deferred key events need a 1 ms wait resolution
+    bool scheduled = minHold != 0 || minGap != 0;
+    if (scheduled) {
+        timeBeginPeriod(1);
     }
 
-    return (int)msg.wParam;
+    // Wait for messages, or for the next tick while key events are
+    // pending in the scheduler.
+    while (true)
+    {
+        MsgWaitForMultipleObjects(0, nullptr, FALSE, g_scheduler.wheel.pending != 0 ? 1 : INFINITE, QS_ALLINPUT);
+        while (PeekMessage(&msg, nullptr, 0, 0, PM_REMOVE))
+        {
+            if (msg.message == WM_QUIT) {
+                if (scheduled) {
+                    timeEndPeriod(1);
+                }
+                return (int)msg.wParam;
+            }
+            TranslateMessage(&msg);
+            DispatchMessage(&msg);
+        }
+        AdvanceKeyEvents(g_scheduler, GetTickMs());
+    }
 }
\ No newline at end of file
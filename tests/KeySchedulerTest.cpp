@@ -0,0 +1,139 @@
+// Checks the key scheduler in KeyScheduler.h against fake ticks. It
+// doesn't need Windows, build and run it from the repository root with
+//   g++ -std=c++17 -I. tests/KeySchedulerTest.cpp -o KeySchedulerTest
+//   ./KeySchedulerTest
+// Returns 0 if all tests passed.
+#include <iostream>
+#include <utility>
+#include "KeyScheduler.h"
+
+static std::vector<key_event> g_events;
+
+static void RecordKeyEvent(const key_event& e)
+{
+    g_events.push_back(e);
+}
+
+static key_scheduler MakeScheduler(uint64_t hold, uint64_t gap)
+{
+    g_events.clear();
+    key_scheduler sched;
+    sched.minHold = hold;
+    sched.minGap = gap;
+    sched.sink = RecordKeyEvent;
+    return sched;
+}
+
+static void PrintEvents()
+{
+    for (const key_event& e : g_events) {
+        std::cout << " " << (e.down ? "down@" : "up@") << e.due;
+    }
+    std::cout << std::endl;
+}
+
+// Compares the recorded events with the expected (tick, down) pairs for
+// key 0.
+static bool CheckKeyEvents(const char* name, const std::vector<std::pair<uint64_t, bool>>& expected)
+{
+    bool ok = g_events.size() == expected.size();
+    for (size_t i = 0; ok && i < expected.size(); ++i) {
+        const key_event& e = g_events[i];
+        ok = e.key == 0 && e.due == expected[i].first && e.down == expected[i].second;
+    }
+    std::cout << (ok ? "PASS " : "FAIL ") << name << ":";
+    PrintEvents();
+    return ok;
+}
+
+int main()
+{
+    bool ok = true;
+
+    // A tap shorter than minHold is held for minHold
+    {
+        key_scheduler sched = MakeScheduler(30, 0);
+        RequestKeyState(sched, 0, true, 10);
+        AdvanceKeyEvents(sched, 15);
+        RequestKeyState(sched, 0, false, 15);
+        AdvanceKeyEvents(sched, 100);
+        ok &= CheckKeyEvents("short tap", { { 10, true }, { 40, false } });
+    }
+
+    // A tap during the gap after a release is delayed, not dropped
+    {
+        key_scheduler sched = MakeScheduler(30, 30);
+        RequestKeyState(sched, 0, true, 0);
+        AdvanceKeyEvents(sched, 40);
+        RequestKeyState(sched, 0, false, 40);
+        AdvanceKeyEvents(sched, 45);
+        RequestKeyState(sched, 0, true, 45);
+        AdvanceKeyEvents(sched, 50);
+        RequestKeyState(sched, 0, false, 50);
+        AdvanceKeyEvents(sched, 200);
+        ok &= CheckKeyEvents("tap in gap", { { 0, true }, { 40, false }, { 70, true }, { 100, false } });
+    }
+
+    // A press while the release is queued cancels the release
+    {
+        key_scheduler sched = MakeScheduler(30, 30);
+        RequestKeyState(sched, 0, true, 0);
+        AdvanceKeyEvents(sched, 10);
+        RequestKeyState(sched, 0, false, 10);
+        AdvanceKeyEvents(sched, 20);
+        RequestKeyState(sched, 0, true, 20);
+        AdvanceKeyEvents(sched, 50);
+        RequestKeyState(sched, 0, false, 50);
+        AdvanceKeyEvents(sched, 200);
+        ok &= CheckKeyEvents("coalesce", { { 0, true }, { 50, false } });
+    }
+
+    // Chatter every 12 ms must not build up lag
+    {
+        key_scheduler sched = MakeScheduler(30, 30);
+        uint64_t tick = 0;
+        for (int i = 0; i < 200; ++i, tick += 12) {
+            AdvanceKeyEvents(sched, tick);
+            RequestKeyState(sched, 0, i % 2 == 0, tick);
+        }
+        AdvanceKeyEvents(sched, tick + 1000);
+        bool bounded = !g_events.empty() && g_events.back().due <= tick + 30 + 30 &&
+            !sched.keys[0].queuedPress.has_value() && !sched.keys[0].queuedRelease.has_value();
+        std::cout << (bounded ? "PASS " : "FAIL ") << "chatter: " << g_events.size()
+            << " events, last at " << (g_events.empty() ? 0 : g_events.back().due)
+            << ", last request at " << tick - 12 << std::endl;
+        ok &= bounded;
+    }
+
+    // Events due on a level 1 boundary are sent on time
+    {
+        key_scheduler sched = MakeScheduler(300, 0);
+        AdvanceKeyEvents(sched, 212);
+        RequestKeyState(sched, 0, true, 212);
+        RequestKeyState(sched, 0, false, 213);
+        AdvanceKeyEvents(sched, 1000);
+        ok &= CheckKeyEvents("level 1 boundary", { { 212, true }, { 512, false } });
+    }
+
+    // A minHold beyond the wheel's range is cut to WHEEL_RANGE, and the
+    // shortened release can still be cancelled
+    {
+        key_scheduler sched = MakeScheduler(100000, 0);
+        RequestKeyState(sched, 0, true, 0);
+        RequestKeyState(sched, 0, false, 1);
+        bool queued = sched.keys[0].queuedRelease.has_value() && sched.keys[0].queuedRelease->due == 1 + WHEEL_RANGE;
+        AdvanceKeyEvents(sched, 2 * WHEEL_RANGE);
+        ok &= CheckKeyEvents("long hold", { { 0, true }, { 1 + WHEEL_RANGE, false } }) && queued;
+
+        sched = MakeScheduler(100000, 0);
+        RequestKeyState(sched, 0, true, 0);
+        RequestKeyState(sched, 0, false, 1);
+        RequestKeyState(sched, 0, true, 2);
+        bool cancelled = sched.wheel.pending == 0;
+        AdvanceKeyEvents(sched, 2 * WHEEL_RANGE);
+        ok &= CheckKeyEvents("long hold cancel", { { 0, true } }) && cancelled;
+    }
+
+    std::cout << (ok ? "All tests passed" : "Some tests failed") << std::endl;
+    return ok ? 0 : 1;
+}